@@ -211,12 +211,47 @@ VOID CalcLoadAddressRange(Elf64_Ehdr* ehdr, UINT64* first, UINT64* last) {
   }
 }
 
+// カーネルをロードするメモリ領域のアライメント (2MiB)
+// 2MiB境界に置くことでカーネルを2MiBページ(ヒュージページ)でマッピングでき、TLBの消費を抑えられる
+#define KERNEL_LOAD_ALIGN 0x200000
+
+/**
+ * メモリマップから size バイトを格納できる KERNEL_LOAD_ALIGN 境界の空き領域(EfiConventionalMemory)を探し、
+ * その先頭アドレスを base に書き込みます。
+ */
+EFI_STATUS FindKernelLoadBase(struct MemoryMap* map, UINT64 size, EFI_PHYSICAL_ADDRESS* base) {
+  EFI_PHYSICAL_ADDRESS iter;
+  for (iter = (EFI_PHYSICAL_ADDRESS)map->buffer;
+       iter < (EFI_PHYSICAL_ADDRESS)map->buffer + map->map_size;
+       iter += map->descriptor_size
+  ) {
+    EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)iter;
+    if (desc->Type != EfiConventionalMemory) {
+      continue;
+    }
+
+    UINT64 region_end = desc->PhysicalStart + desc->NumberOfPages * EFI_PAGE_SIZE;
+    // 領域の先頭を2MiB境界に切り上げる (0番地はNULLと区別できないので使わない)
+    UINT64 candidate = ALIGN_VALUE(desc->PhysicalStart, KERNEL_LOAD_ALIGN);
+    if (candidate == 0) {
+      candidate = KERNEL_LOAD_ALIGN;
+    }
+    if (candidate < region_end && size <= region_end - candidate) {
+      *base = candidate;
+      return EFI_SUCCESS;
+    }
+  }
+  return EFI_NOT_FOUND;
+}
+
 /**
  * p_type == PT_LOAD であるセグメントに対して2つの処理を行う
- * 1. segm_in_fileが指す一時領域から p_vaddr が指す最終目的地へデータをコピーする
+ * 1. segm_in_fileが指す一時領域から load_bias + p_vaddr が指す最終目的地へデータをコピーする
  * 2. セグメントのメモリ上のサイズがファイル上のサイズより大きい場合(remain_bytes > 0)、残りを0で埋める(SetMem())
+ *
+ * load_bias はリンク時のアドレス(p_vaddr)と実際にロードするアドレスの差分
  */
-VOID CopyLoadSegments(Elf64_Ehdr* ehdr) {
+VOID CopyLoadSegments(Elf64_Ehdr* ehdr, UINT64 load_bias) {
   Elf64_Phdr* phdr = (Elf64_Phdr*)((UINT64)ehdr + ehdr->e_phoff);
   for (Elf64_Half i = 0; i < ehdr->e_phnum; i++) {
     if (phdr[i].p_type != PT_LOAD) {
@@ -225,9 +260,10 @@ VOID CopyLoadSegments(Elf64_Ehdr* ehdr) {
 
     // 一時領域から最終目的地へデータをコピー
     UINT64 segm_in_file = (UINT64)ehdr + phdr[i].p_offset;
+    UINT64 segm_in_memory = load_bias + phdr[i].p_vaddr;
     // CopyMem: https://github.com/tianocore/edk2/blob/edk2-stable202302/MdePkg/Include/Library/BaseMemoryLib.h#L33
     CopyMem(
-      (VOID*)phdr[i].p_vaddr,  // IN VOID   *Destination
+      (VOID*)segm_in_memory,   // IN VOID   *Destination
       (VOID*)segm_in_file,     // IN VOID   *Source
       phdr[i].p_filesz         // IN UINTN  Length
     );
@@ -236,13 +272,61 @@ VOID CopyLoadSegments(Elf64_Ehdr* ehdr) {
     UINTN remain_bytes = phdr[i].p_memsz - phdr[i].p_filesz;
     // SetMem: https://github.com/tianocore/edk2/blob/edk2-stable202302/MdePkg/Include/Library/BaseMemoryLib.h#L55
     SetMem(
-      (VOID*)(phdr[i].p_vaddr + phdr[i].p_filesz),  // IN VOID   *Buffer
+      (VOID*)(segm_in_memory + phdr[i].p_filesz),   // IN VOID   *Buffer
       remain_bytes,                                 // IN UINTN  Size
       0                                             // IN UINT8  Value
     );
   }
 }
 
+/**
+ * PT_DYNAMICセグメントから再配置テーブル(DT_RELA)を探し、ロード済みのカーネルに再配置を適用する
+ * static PIE のカーネルには R_X86_64_RELATIVE (ロードアドレス + r_addend を書き込む) しか現れない
+ */
+EFI_STATUS ApplyRelocations(Elf64_Ehdr* ehdr, UINT64 load_bias) {
+  Elf64_Phdr* phdr = (Elf64_Phdr*)((UINT64)ehdr + ehdr->e_phoff);
+  Elf64_Dyn* dyn = NULL;
+  for (Elf64_Half i = 0; i < ehdr->e_phnum; i++) {
+    if (phdr[i].p_type == PT_DYNAMIC) {
+      dyn = (Elf64_Dyn*)((UINT64)ehdr + phdr[i].p_offset);
+      break;
+    }
+  }
+  if (dyn == NULL) {
+    // 再配置情報がない
+    return EFI_SUCCESS;
+  }
+
+  UINT64 rela_addr = 0;
+  UINT64 rela_size = 0;
+  UINT64 rela_ent = sizeof(Elf64_Rela);
+  for (; dyn->d_tag != DT_NULL; dyn++) {
+    switch (dyn->d_tag) {
+      case DT_RELA: rela_addr = dyn->d_un.d_ptr; break;
+      case DT_RELASZ: rela_size = dyn->d_un.d_val; break;
+      case DT_RELAENT: rela_ent = dyn->d_un.d_val; break;
+    }
+  }
+  if (rela_addr == 0 || rela_size == 0) {
+    return EFI_SUCCESS;
+  }
+
+  // DT_RELA は仮想アドレスなので、ロード済みのメモリ上から読む
+  for (UINT64 offset = 0; offset < rela_size; offset += rela_ent) {
+    Elf64_Rela* rela = (Elf64_Rela*)(load_bias + rela_addr + offset);
+    switch (ELF64_R_TYPE(rela->r_info)) {
+      case R_X86_64_NONE:
+        break;
+      case R_X86_64_RELATIVE:
+        *(UINT64*)(load_bias + rela->r_offset) = load_bias + rela->r_addend;
+        break;
+      default:
+        return EFI_UNSUPPORTED;
+    }
+  }
+  return EFI_SUCCESS;
+}
+
 EFI_STATUS OpenGOP(EFI_HANDLE image_handle, EFI_GRAPHICS_OUTPUT_PROTOCOL** gop) {
   EFI_STATUS status;
   UINTN num_gop_handles = 0;
@@ -475,10 +559,32 @@ EFI_STATUS EFIAPI UefiMain(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_tab
    * カーネルファイルの最終ロード先のメモリを確保
    */
   Elf64_Ehdr* kernel_ehdr = (Elf64_Ehdr*)kernel_buffer;
+  if (kernel_ehdr->e_type != ET_DYN) {
+    // カーネルは任意のアドレスにロードできるよう static PIE としてビルドされている必要がある
+    Print(L"kernel is not a position independent executable: e_type = %u\n", kernel_ehdr->e_type);
+    Halt();
+  }
   UINT64 kernel_first_addr, kernel_last_addr;
   CalcLoadAddressRange(kernel_ehdr, &kernel_first_addr, &kernel_last_addr);
-  
-  UINTN num_pages = (kernel_last_addr - kernel_first_addr + 0xfff) / 0x1000;
+  // LOADセグメントの先頭をページ境界に揃える
+  kernel_first_addr &= ~(UINT64)(EFI_PAGE_SIZE - 1);
+
+  UINTN num_pages = EFI_SIZE_TO_PAGES(kernel_last_addr - kernel_first_addr);
+
+  // カーネル読み込み用の一時領域を確保したことでメモリマップが変化しているので取得し直す
+  status = GetMemoryMap(&memmap);
+  if (EFI_ERROR(status)) {
+    Print(L"failed to get memory map: %r\n", status);
+    Halt();
+  }
+  // メモリマップから2MiB境界の空き領域を探してロード先とする
+  EFI_PHYSICAL_ADDRESS kernel_base_addr;
+  status = FindKernelLoadBase(&memmap, EFI_PAGES_TO_SIZE(num_pages), &kernel_base_addr);
+  if (EFI_ERROR(status)) {
+    Print(L"failed to find free memory for kernel (%lu pages): %r\n", num_pages, status);
+    Halt();
+  }
+
   // EFI_ALLOCATE_PAGES: https://github.com/tianocore/edk2/blob/edk2-stable202302/MdePkg/Include/Uefi/UefiSpec.h#L186
   status = gBS->AllocatePages(
     AllocateAddress,   // IN     EFI_ALLOCATE_TYPE    Type : https://github.com/tianocore/edk2/blob/edk2-stable202302/MdePkg/Include/Uefi/UefiSpec.h#L29
@@ -490,7 +596,7 @@ EFI_STATUS EFIAPI UefiMain(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_tab
                        //   EfiLoaderCode: ロードされたアプリケーションのコードセクション
                        //   EfiLoaderData: ロードされたアプリケーションのデータセクション
     num_pages,         // IN     UINTN                Pages
-    &kernel_first_addr // IN OUT EFI_PHYSICAL_ADDRESS *Memory
+    &kernel_base_addr  // IN OUT EFI_PHYSICAL_ADDRESS *Memory
   );
   if (EFI_ERROR(status)) {
     Print(L"failed to allocate pages: %r", status);
@@ -498,29 +604,38 @@ EFI_STATUS EFIAPI UefiMain(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_tab
   }
 
   /**
-   * カーネルファイル(ELFファイル)LOADセグメントを確保したメモリ領域にコピー
+   * カーネルファイル(ELFファイル)LOADセグメントを確保したメモリ領域にコピーし、再配置を適用する
    */
-  CopyLoadSegments(kernel_ehdr);
-  Print(L"Kernel: 0x%0lx - 0x%lx\n", kernel_first_addr, kernel_last_addr);
-
-  // 確保したメモリを開放
-  // EFI_FREE_POOL: https://github.com/tianocore/edk2/blob/edk2-stable202302/MdePkg/Include/Uefi/UefiSpec.h?utm_source=chatgpt.com#L285
-  status = gBS->FreePool(kernel_buffer);
+  // リンク時のアドレスと実際のロード先アドレスとの差分
+  UINT64 kernel_load_bias = kernel_base_addr - kernel_first_addr;
+  CopyLoadSegments(kernel_ehdr, kernel_load_bias);
+  status = ApplyRelocations(kernel_ehdr, kernel_load_bias);
+  if (EFI_ERROR(status)) {
+    Print(L"failed to apply relocations: %r\n", status);
+    Halt();
+  }
+  Print(L"Kernel: 0x%0lx - 0x%lx\n",
+    kernel_base_addr,
+    kernel_base_addr + (kernel_last_addr - kernel_first_addr)
+  );
 
   /**
-   * カーネルの起動
+   * カーネルのエントリポイントを取得
    */
   // UINT64: https://github.com/tianocore/edk2/blob/edk2-stable202302/MdePkg/Include/X64/ProcessorBind.h#L180
-  // メモリ上でエントリーポイントがおいてあるアドレス
-  // ELF形式の仕様では64bit用のELFのエントリポイントアドレスはオフセット24byteの位置から8バイト整数として書かれる事になっている
+  // ELFヘッダの e_entry はリンク時のアドレスなので、ロード先との差分を足す
   // ELFの情報は readelf -h build/kernel/kernel.elf で確認できる
-  UINT64 entry_addr = *(UINT64*)(kernel_first_addr + 24);
+  UINT64 entry_addr = kernel_load_bias + kernel_ehdr->e_entry;
 
   // エントリポイントをC言語の関数として呼び出すために、関数ポインタにキャスト
   typedef void EntryPointType(UINT64, UINT64);
   EntryPointType* entry_point = (EntryPointType*)entry_addr;
   Print(L"entry_point: 0x%p\n", entry_point);
 
+  // 確保したメモリを開放 (kernel_ehdr はこの一時領域を指しているので、以降は参照しない)
+  // EFI_FREE_POOL: https://github.com/tianocore/edk2/blob/edk2-stable202302/MdePkg/Include/Uefi/UefiSpec.h?utm_source=chatgpt.com#L285
+  status = gBS->FreePool(kernel_buffer);
+
   /**
    * カーネル起動前にUEFI BIOSのブートサービスを停止
    */
@@ -31,6 +31,12 @@ typedef struct {
   Elf64_Half    e_shstrndx;
 } Elf64_Ehdr;
 
+// e_type: ELFファイルの種別
+#define ET_NONE 0
+#define ET_REL  1
+#define ET_EXEC 2  // 実行ファイル (リンク時のアドレスにロードする必要がある)
+#define ET_DYN  3  // 共有オブジェクト / PIE (任意のアドレスにロードできる)
+
 // 64bit ELFファイルのプログラムヘッダの要素
 typedef struct {
   Elf64_Word  p_type;    // PHDR, LOADなどのセグメント種別
@@ -50,4 +56,31 @@ typedef struct {
 #define PT_NOTE    4
 #define PT_SHLIB   5
 #define PT_PHDR    6
-#define PT_TLS     7
\ No newline at end of file
+#define PT_TLS     7
+
+// 64bit ELFファイルのダイナミックセクション(PT_DYNAMICセグメント)の要素
+typedef struct {
+  Elf64_Sxword d_tag;  // DT_RELA などのエントリ種別
+  union {
+    Elf64_Xword d_val;
+    Elf64_Addr  d_ptr;
+  } d_un;
+} Elf64_Dyn;
+
+#define DT_NULL    0
+#define DT_RELA    7   // Elf64_Rela(配列)の仮想アドレス
+#define DT_RELASZ  8   // Elf64_Rela(配列)全体のサイズ
+#define DT_RELAENT 9   // Elf64_Rela(配列)の要素のサイズ
+
+// 64bit ELFファイルの再配置情報 (加数付き)
+typedef struct {
+  Elf64_Addr   r_offset;  // 再配置を適用する仮想アドレス
+  Elf64_Xword  r_info;    // 上位32bitがシンボルインデックス、下位32bitが再配置の種別
+  Elf64_Sxword r_addend;  // 加数
+} Elf64_Rela;
+
+#define ELF64_R_SYM(i)  ((i) >> 32)
+#define ELF64_R_TYPE(i) ((i) & 0xffffffffL)
+
+#define R_X86_64_NONE     0
+#define R_X86_64_RELATIVE 8   // ロードアドレス + r_addend を書き込む